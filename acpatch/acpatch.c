@@ -2,8 +2,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <memory.h>
+#include <string.h>
 #include <assert.h>
 #include <time.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*******************************************************************************
     
@@ -137,6 +143,257 @@ uint32_t db_alloc(
     return free_head;
 }
 
+/*
+    In-memory map of the free list, sorted by address. Lets a growing object
+    take blocks adjacent to its chain instead of whatever the free head is.
+*/
+typedef struct {
+    uint32_t addr;              /* Offset of free block */
+    uint32_t next;              /* Next pointer as found on disk, 0 once allocated */
+} freeblock_t;
+
+typedef struct {
+    uint32_t block_size;        /* Block size of database */
+    uint32_t count;             /* Number of blocks in map */
+    freeblock_t* blocks;        /* Free blocks sorted by address */
+} freemap_t;
+
+int freemap_cmp(const void* a, const void* b)
+{
+    uint32_t x = ((const freeblock_t*) a)->addr;
+    uint32_t y = ((const freeblock_t*) b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+void freemap_release(
+    freemap_t* fm)
+{
+    free(fm->blocks);
+    fm->blocks = NULL;
+    fm->count = 0;
+}
+
+/*
+    Load free list into map. Returns 1 on success, -1 if out of memory and
+    0 if the list does not end cleanly within the header's free count, so
+    a partial map is never written back over it
+*/
+int freemap_load(
+    FILE* db,                   /* Database file handle */
+    freemap_t* fm)              /* Map to fill */
+{
+    char header[1024];
+    char next[4];
+    uint32_t offset, free_count;
+
+    /* Read header */
+    db_read_block(db, 0, 1024, header, sizeof(header));
+    fm->block_size = header_get_blocksize(header);
+    free_count = header_get_freecount(header);
+    fm->count = 0;
+    fm->blocks = malloc((free_count + 1) * sizeof(freeblock_t));
+    if (!fm->blocks)
+        return -1;
+
+    /* Walk free list, reading only the next pointer of each block */
+    offset = header_get_free_head(header) & 0x7fffffff;
+    while (offset) {
+        if (fm->count == free_count) {
+            freemap_release(fm);
+            return 0;
+        }
+        db_read_block(db, offset, 4, next, sizeof(next));
+        if (!(block_get_next(next) & 0x80000000)) {
+            freemap_release(fm);
+            return 0;
+        }
+        fm->blocks[fm->count].addr = offset;
+        fm->blocks[fm->count].next = block_get_next(next);
+        fm->count++;
+        offset = block_get_next(next) & 0x7fffffff;
+    }
+
+    qsort(fm->blocks, fm->count, sizeof(freeblock_t), freemap_cmp);
+    return 1;
+}
+
+/*
+    Grab a free block, preferring the one right after prev, then the
+    smallest run that holds all wanted blocks, then the largest run
+*/
+uint32_t freemap_alloc(
+    freemap_t* fm,              /* Free map */
+    uint32_t prev,              /* Last block of chain being extended */
+    uint32_t wanted)            /* Number of blocks still needed */
+{
+    uint32_t lo, hi, mid, run, best, best_run, i, j;
+    freeblock_t* b = fm->blocks;
+
+    /* Block adjacent to the chain */
+    lo = 0;
+    hi = fm->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (b[mid].addr < prev + fm->block_size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < fm->count && b[lo].addr == prev + fm->block_size && b[lo].next) {
+        b[lo].next = 0;
+        return b[lo].addr;
+    }
+
+    /* Best fitting run of contiguous blocks */
+    best = fm->count;
+    best_run = 0;
+    for (i = 0; i < fm->count; i = j) {
+        if (!b[i].next) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < fm->count && b[j].next
+                && b[j].addr == b[j - 1].addr + fm->block_size; j++)
+            ;
+        run = j - i;
+        if (best == fm->count
+                || (run >= wanted && (best_run < wanted || run < best_run))
+                || (run < wanted && best_run < wanted && run > best_run)) {
+            best = i;
+            best_run = run;
+        }
+    }
+    if (best == fm->count)
+        return 0;
+
+    b[best].next = 0;
+    return b[best].addr;
+}
+
+/*
+    Write remaining free blocks back as an address ordered list in one pass
+*/
+void freemap_store(
+    FILE* db,                   /* Database file handle */
+    freemap_t* fm)              /* Free map */
+{
+    char header[1024];
+    char next[4];
+    uint32_t i, head, tail, count;
+
+    head = tail = count = 0;
+    for (i = 0; i < fm->count; i++) {
+        if (!fm->blocks[i].next)
+            continue;
+        if (tail) {
+            block_set_next(next, fm->blocks[i].addr | 0x80000000);
+            if (block_get_next(next) != fm->blocks[tail - 1].next)
+                db_write_block(db, fm->blocks[tail - 1].addr, 4, next, sizeof(next));
+        } else {
+            head = fm->blocks[i].addr;
+        }
+        tail = i + 1;
+        count++;
+    }
+    if (tail) {
+        block_set_next(next, 0x80000000);
+        if (block_get_next(next) != fm->blocks[tail - 1].next)
+            db_write_block(db, fm->blocks[tail - 1].addr, 4, next, sizeof(next));
+    }
+
+    db_read_block(db, 0, 1024, header, sizeof(header));
+    header_set_free_head(header, head);
+    header_set_free_tail(header, tail ? fm->blocks[tail - 1].addr : 0);
+    header_set_freecount(header, count);
+    db_write_block(db, 0, 1024, header, sizeof(header));
+}
+
+#define DB_RUN_BYTES 0x40000    /* Largest run read or written in one go */
+
+/*
+    Blocks in a run of at most DB_RUN_BYTES
+*/
+int db_run_blocks(
+    int block_size,
+    int max_blocks)
+{
+    int blocks = DB_RUN_BYTES / block_size;
+    if (blocks < 1)
+        blocks = 1;
+    return blocks < max_blocks ? blocks : max_blocks;
+}
+
+/*
+    Follow a chain for up to max_blocks blocks. Blocks are read in runs,
+    guessing that the chain continues with the adjacent block, so a
+    contiguous chain costs one read per DB_RUN_BYTES. The guess starts at
+    the whole remainder and after a break grows from the run just seen.
+    Returns the number of blocks followed, 0 if out of memory.
+*/
+int db_read_chain(
+    FILE* db,                   /* Database file handle */
+    uint32_t offset,            /* Offset of first block */
+    int block_size,             /* Block size of database */
+    int max_blocks,             /* Blocks to follow at most */
+    uint32_t* addrs,            /* Out: block offsets, or NULL */
+    char* buffer,               /* Out: block data, or NULL */
+    int buffer_size,            /* Bytes of block data wanted */
+    uint32_t* tail_next)        /* Out: next pointer of last block followed */
+{
+    char* run;
+    char* block;
+    int count, guess, got, ix, chunk, run_blocks;
+
+    *tail_next = 0;
+    if (max_blocks <= 0)
+        return 0;
+    run_blocks = db_run_blocks(block_size, max_blocks);
+    run = malloc((size_t) run_blocks * block_size);
+    if (!run)
+        return 0;
+    count = 0;
+    guess = run_blocks;
+
+    while (count < max_blocks && offset) {
+        if (guess > max_blocks - count)
+            guess = max_blocks - count;
+        if (guess > run_blocks)
+            guess = run_blocks;
+
+        fseek(db, offset, SEEK_SET);
+        got = fread(run, block_size, guess, db);
+        if (!got)
+            break;
+
+        for (ix = 0; ix < got; ix++) {
+            block = run + ix * block_size;
+            if (addrs)
+                addrs[count] = offset;
+            if (buffer && buffer_size > 0) {
+                chunk = buffer_size < block_size - 4 ? buffer_size : block_size - 4;
+                memcpy(buffer, block_get_data(block), chunk);
+                buffer += chunk;
+                buffer_size -= chunk;
+            }
+            count++;
+            *tail_next = block_get_next(block);
+            if (*tail_next != offset + block_size)
+                break;
+            offset += block_size;
+        }
+
+        /* Run ended early, next guess grows from what was seen */
+        if (ix < got) {
+            guess = 2 * (ix + 1);
+            offset = *tail_next;
+        } else {
+            guess = 2 * got;
+        }
+    }
+    free(run);
+    return count;
+}
+
 /*
     Read file from database
 */
@@ -148,31 +405,27 @@ void db_read_object(
     char* buffer,               /* Buffer to read file into */
     unsigned int buffer_size)   /* Size of buffer */
 {
-    int bytes_remaining;
-    char* block;
+    uint32_t next;
 
     assert(file_size <= buffer_size);
-    bytes_remaining = file_size;
-    block = malloc(block_size);
-    
-    while (bytes_remaining > 0 && offset) {
-        db_read_block(db, offset, block_size, block, block_size);
-        if (bytes_remaining > block_size - 4) {
-            memcpy(buffer, block_get_data(block), block_size - 4);
-            buffer += block_size - 4;
-            bytes_remaining -= block_size - 4;
-        } else {
-            memcpy(buffer, block_get_data(block), bytes_remaining);
-            buffer += bytes_remaining;
-            bytes_remaining = 0;
-        }
-        offset = block_get_next(block);
-    }
-    free(block);
+    if (file_size <= 0)
+        return;
+
+    db_read_chain(
+        db,
+        offset,
+        block_size,
+        (file_size + block_size - 5) / (block_size - 4),
+        NULL,
+        buffer,
+        file_size,
+        &next);
 }
 
 /*
-    Write file to database
+    Write file to database. The existing chain is resolved first so every
+    block can be written whole with its next pointer already known, one
+    fwrite per run of adjacent blocks
 */
 void db_write_object(
     FILE* db,                   /* Database file handle */
@@ -180,37 +433,65 @@ void db_write_object(
     int block_size,             /* Block size of database */
     int file_size,              /* Size of file to be read */
     char* buffer,               /* Buffer to read file into */
-    unsigned int buffer_size)   /* Size of buffer */
+    unsigned int buffer_size,   /* Size of buffer */
+    freemap_t* fm)              /* Free map to allocate from, NULL for db_alloc */
 {
     int bytes_remaining;
-    uint32_t next;
+    int needed, count, ix, run_start, run_blocks, chunk;
+    uint32_t tail_next;
+    uint32_t* addrs;
+    char* run;
     char* block;
     
     assert(file_size <= buffer_size);
+    if (file_size <= 0 || !offset)
+        return;
+    needed = (file_size + block_size - 5) / (block_size - 4);
+    addrs = malloc(needed * sizeof(uint32_t));
+    if (!addrs)
+        return;
+
+    /* Resolve existing chain, then extend it */
+    count = db_read_chain(db, offset, block_size, needed, addrs, NULL, 0, &tail_next);
+    if (count < needed)
+        tail_next = 0;
+    for (; count < needed && count > 0; count++) {
+        if (fm)
+            addrs[count] = freemap_alloc(fm, addrs[count - 1], needed - count);
+        else
+            addrs[count] = db_alloc(db);
+        if (!addrs[count])
+            break;
+    }
+
+    /* Write runs of adjacent blocks */
+    run_blocks = db_run_blocks(block_size, count);
+    run = count ? malloc((size_t) run_blocks * block_size) : NULL;
+    if (!run) {
+        free(addrs);
+        return;
+    }
     bytes_remaining = file_size;
-    block = malloc(block_size);
-    
-    while (bytes_remaining > 0 && offset) {
-        db_read_block(db, offset, block_size, block, block_size);
-        if (bytes_remaining > block_size - 4) {
-            memcpy(block_get_data(block), buffer, block_size - 4);
-            buffer += block_size - 4;
-            bytes_remaining -= block_size - 4;
-        } else {
-            memcpy(block_get_data(block), buffer, bytes_remaining);
-            buffer += bytes_remaining;
-            bytes_remaining = 0;
-        }
-        next = block_get_next(block);
-        if (!next && bytes_remaining) {
-            next = db_alloc(db);
-            block_set_next(block, next);
+    run_start = 0;
+    for (ix = 0; ix < count; ix++) {
+        block = run + (ix - run_start) * block_size;
+        block_set_next(block, ix + 1 < count ? addrs[ix + 1] : tail_next);
+        chunk = bytes_remaining < block_size - 4 ? bytes_remaining : block_size - 4;
+        memcpy(block_get_data(block), buffer, chunk);
+        memset(block_get_data(block) + chunk, 0, block_size - 4 - chunk);
+        buffer += chunk;
+        bytes_remaining -= chunk;
+
+        if (ix + 1 == count || addrs[ix + 1] != addrs[ix] + block_size
+                || ix + 1 - run_start == run_blocks) {
+            fseek(db, addrs[run_start], SEEK_SET);
+            fwrite(run, block_size, ix + 1 - run_start, db);
+            run_start = ix + 1;
         }
-        db_write_block(db, offset, block_size, block, block_size);
-        offset = next;
     }
     
-    free(block);
+    free(run);
+    free(addrs);
 }
 
 /*******************************************************************************
@@ -259,6 +540,183 @@ uint32_t* dir_get_entry(
         return (uint32_t*)(dir + ((MAX_BRANCH + 1) * sizeof(uint32_t)) + entry_ix * 24);
 }
 
+/*******************************************************************************
+    
+    DIRECTORY CACHE PROCEDURES
+    
+********************************************************************************/
+
+#define DIRCACHE_SLOTS 64
+#define DIRCACHE_KEYS 64        /* MAX_BRANCH - 1 keys padded for SIMD loads */
+
+/*
+    Directory node decoded once, with object IDs in their own array so the
+    in-node search runs over contiguous keys instead of a 24 byte stride
+*/
+typedef struct {
+    uint32_t addr;              /* Address of directory, 0 if slot is unused */
+    uint32_t stamp;             /* Last use, for LRU eviction */
+    uint32_t leaf;
+    uint32_t entry_count;
+    uint32_t ids[DIRCACHE_KEYS];            /* Object IDs, padded with 0xFFFFFFFF */
+    uint32_t branches[MAX_BRANCH];
+    uint32_t entries[MAX_BRANCH - 1][6];
+} dirnode_t;
+
+typedef struct {
+    uint32_t block_size;        /* Block size of database */
+    uint32_t clock;             /* Use counter */
+    int slot_count;
+    dirnode_t* slots;
+} dircache_t;
+
+/*
+    Returns 0 on failure
+*/
+int dircache_init(
+    dircache_t* cache,
+    uint32_t block_size,
+    int slot_count)
+{
+    cache->block_size = block_size;
+    cache->clock = 0;
+    cache->slot_count = slot_count;
+    cache->slots = calloc(slot_count, sizeof(dirnode_t));
+    return cache->slots != NULL;
+}
+
+void dircache_release(
+    dircache_t* cache)
+{
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->slot_count = 0;
+}
+
+/*
+    Drop a directory from the cache after it has been written
+*/
+void dircache_invalidate(
+    dircache_t* cache,
+    uint32_t dir_addr)
+{
+    int i;
+    for (i = 0; i < cache->slot_count; i++) {
+        if (cache->slots[i].addr == dir_addr)
+            cache->slots[i].addr = 0;
+    }
+}
+
+/*
+    Fetch decoded directory, reading it from the database on a miss
+*/
+dirnode_t* dircache_get(
+    FILE* db,
+    dircache_t* cache,
+    uint32_t dir_addr)
+{
+    int i, victim;
+    uint32_t entry_ix;
+    char dir[DIRECTORY_SIZE];
+    dirnode_t* node;
+
+    victim = 0;
+    for (i = 0; i < cache->slot_count; i++) {
+        if (cache->slots[i].addr == dir_addr) {
+            cache->slots[i].stamp = ++cache->clock;
+            return &cache->slots[i];
+        }
+        if (cache->slots[victim].addr
+                && (!cache->slots[i].addr || cache->slots[i].stamp < cache->slots[victim].stamp))
+            victim = i;
+    }
+
+    /* Decode directory into victim slot */
+    db_read_object(db, dir_addr, cache->block_size, DIRECTORY_SIZE, dir, sizeof(dir));
+    node = &cache->slots[victim];
+    node->addr = dir_addr;
+    node->stamp = ++cache->clock;
+    node->leaf = dir_is_leaf(dir);
+    node->entry_count = dir_entry_count(dir);
+    if (node->entry_count > MAX_BRANCH - 1)
+        node->entry_count = MAX_BRANCH - 1;
+    memcpy(node->branches, dir, sizeof(node->branches));
+    for (entry_ix = 0; entry_ix < DIRCACHE_KEYS; entry_ix++)
+        node->ids[entry_ix] = 0xFFFFFFFF;
+    for (entry_ix = 0; entry_ix < node->entry_count; entry_ix++) {
+        memcpy(node->entries[entry_ix], dir_get_entry(dir, entry_ix), 24);
+        node->ids[entry_ix] = node->entries[entry_ix][ENTRY_OBJECTID];
+    }
+    return node;
+}
+
+/*
+    Count the keys in a directory less than object_id
+*/
+uint32_t dirnode_lower_bound(
+    dirnode_t* node,
+    uint32_t object_id)
+{
+    uint32_t count = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+    /* SSE2/AVX2 only compare signed, so flip the sign bit of both sides */
+    uint32_t ix;
+    int mask;
+#if defined(__AVX2__)
+    __m256i flip = _mm256_set1_epi32(0x80000000);
+    __m256i id = _mm256_xor_si256(_mm256_set1_epi32(object_id), flip);
+    for (ix = 0; ix < node->entry_count; ix += 8) {
+        __m256i keys = _mm256_loadu_si256((const __m256i*) (node->ids + ix));
+        keys = _mm256_xor_si256(keys, flip);
+        mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(id, keys)));
+#else
+    __m128i flip = _mm_set1_epi32(0x80000000);
+    __m128i id = _mm_xor_si128(_mm_set1_epi32(object_id), flip);
+    for (ix = 0; ix < node->entry_count; ix += 4) {
+        __m128i keys = _mm_loadu_si128((const __m128i*) (node->ids + ix));
+        keys = _mm_xor_si128(keys, flip);
+        mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(id, keys)));
+#endif
+        while (mask) {
+            count++;
+            mask &= mask - 1;
+        }
+    }
+#else
+    while (count < node->entry_count && node->ids[count] < object_id)
+        count++;
+#endif
+    return count;
+}
+
+/*
+    Walk the tree from dir_addr down to object_id, returns the directory
+    holding it or NULL if not found
+*/
+dirnode_t* dir_search(
+    FILE* db,
+    dircache_t* cache,
+    uint32_t dir_addr,
+    uint32_t object_id,
+    uint32_t* entry_ix /* out */)
+{
+    dirnode_t* node;
+    uint32_t ix;
+
+    while (dir_addr) {
+        node = dircache_get(db, cache, dir_addr);
+        ix = dirnode_lower_bound(node, object_id);
+        if (ix < node->entry_count && node->ids[ix] == object_id) {
+            *entry_ix = ix;
+            return node;
+        }
+        if (node->leaf)
+            break;
+        dir_addr = node->branches[ix];
+    }
+    return NULL;
+}
+
 /*******************************************************************************
     
     CRAWLER PROCEDURES
@@ -299,7 +757,7 @@ int crawl_r(
     for (entry_ix = 0; entry_ix < entry_count; entry_ix++) {
         entry = dir_get_entry(dir, entry_ix);
         if (cb(entry, params)) {
-            db_write_object(db, dir_addr, block_size, DIRECTORY_SIZE, dir, sizeof(dir));
+            db_write_object(db, dir_addr, block_size, DIRECTORY_SIZE, dir, sizeof(dir), NULL);
             return 1;
         }
     }
@@ -330,33 +788,514 @@ uint32_t cb_print(uint32_t* entry, void* params) {
     return 0;
 }
 
-uint32_t cb_find(uint32_t* entry, void* params) {
-    uint32_t* newEntry = (uint32_t*) params;
-    uint32_t r = 0;
-    if (entry[ENTRY_OBJECTID] == newEntry[ENTRY_OBJECTID]) {
-        newEntry[ENTRY_BITFLAGS]    = entry[ENTRY_BITFLAGS];
-        newEntry[ENTRY_OBJECTID]    = entry[ENTRY_OBJECTID];
-        newEntry[ENTRY_FILEOFFSET]  = entry[ENTRY_FILEOFFSET];
-        newEntry[ENTRY_FILESIZE]    = entry[ENTRY_FILESIZE];
-        newEntry[ENTRY_DATE]        = entry[ENTRY_DATE];
-        newEntry[ENTRY_VERSION]     = entry[ENTRY_VERSION];
-        r = 1;
+/*******************************************************************************
+    
+    OVERLAY PROCEDURES
+    
+********************************************************************************/
+
+#define MAX_OVERLAY 16
+
+/*
+    Directory entry tagged with the database it came from
+*/
+typedef struct {
+    uint32_t entry[6];
+    int dat_ix;                 /* Index of database in overlay stack */
+} overlay_entry_t;
+
+/*
+    Ordered stack of databases, later ones override earlier ones. Single
+    objects are found by searching each database from the top down; the
+    merged index sorted by object ID is only built when listing
+*/
+typedef struct {
+    int dat_count;
+    FILE* dats[MAX_OVERLAY];
+    char* names[MAX_OVERLAY];
+    char headers[MAX_OVERLAY][1024];
+    dircache_t caches[MAX_OVERLAY];
+    int entry_count;
+    int entry_capacity;
+    overlay_entry_t* entries;
+    int current;                /* Database being indexed */
+    int out_of_memory;          /* Set if the index could not grow */
+} overlay_t;
+
+/*
+    Never returns 1, since crawl would take that as a modified entry and
+    write the directory back
+*/
+uint32_t cb_collect(uint32_t* entry, void* params) {
+    overlay_t* ov = (overlay_t*) params;
+    overlay_entry_t* grown;
+
+    if (ov->out_of_memory)
+        return 0;
+    if (ov->entry_count == ov->entry_capacity) {
+        grown = realloc(ov->entries,
+            (ov->entry_capacity ? ov->entry_capacity * 2 : 1024) * sizeof(overlay_entry_t));
+        if (!grown) {
+            ov->out_of_memory = 1;
+            return 0;
+        }
+        ov->entry_capacity = ov->entry_capacity ? ov->entry_capacity * 2 : 1024;
+        ov->entries = grown;
+    }
+    memcpy(ov->entries[ov->entry_count].entry, entry, 24);
+    ov->entries[ov->entry_count].dat_ix = ov->current;
+    ov->entry_count++;
+    return 0;
+}
+
+/*
+    Order by object ID, highest priority database first
+*/
+int overlay_cmp(const void* a, const void* b)
+{
+    const overlay_entry_t* x = (const overlay_entry_t*) a;
+    const overlay_entry_t* y = (const overlay_entry_t*) b;
+    if (x->entry[ENTRY_OBJECTID] != y->entry[ENTRY_OBJECTID])
+        return x->entry[ENTRY_OBJECTID] < y->entry[ENTRY_OBJECTID] ? -1 : 1;
+    return y->dat_ix - x->dat_ix;
+}
+
+void overlay_close(
+    overlay_t* ov)
+{
+    int i;
+    for (i = 0; i < ov->dat_count; i++) {
+        fclose(ov->dats[i]);
+        dircache_release(&ov->caches[i]);
+    }
+    free(ov->entries);
+    ov->dat_count = 0;
+    ov->entries = NULL;
+    ov->entry_count = 0;
+}
+
+/*
+    Open comma separated list of databases, returns 0 on failure
+*/
+int overlay_open(
+    overlay_t* ov,
+    char* dat_list)
+{
+    char* name;
+
+    memset(ov, 0, sizeof(overlay_t));
+    for (name = strtok(dat_list, ","); name; name = strtok(NULL, ",")) {
+        if (ov->dat_count == MAX_OVERLAY) {
+            printf("Too many databases, at most %d can be stacked.\n", MAX_OVERLAY);
+            overlay_close(ov);
+            return 0;
+        }
+        ov->dats[ov->dat_count] = fopen(name, "rb");
+        if (!ov->dats[ov->dat_count]) {
+            printf("Failed to open database %s.\n", name);
+            overlay_close(ov);
+            return 0;
+        }
+        ov->names[ov->dat_count] = name;
+        db_read_block(ov->dats[ov->dat_count], 0, 1024, ov->headers[ov->dat_count], 1024);
+        ov->dat_count++;
+        if (!dircache_init(&ov->caches[ov->dat_count - 1],
+                header_get_blocksize(ov->headers[ov->dat_count - 1]), DIRCACHE_SLOTS)) {
+            printf("Out of memory.\n");
+            overlay_close(ov);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    Build merged index of every object in the stack, returns 0 on failure
+*/
+int overlay_build_index(
+    overlay_t* ov)
+{
+    int i, j;
+
+    /* Collect every entry of every database */
+    for (ov->current = 0; ov->current < ov->dat_count; ov->current++) {
+        crawl(ov->dats[ov->current], ov->headers[ov->current], cb_collect, ov);
+        if (ov->out_of_memory) {
+            printf("Out of memory.\n");
+            return 0;
+        }
+    }
+
+    /* Sort and keep only the highest priority entry of each object */
+    qsort(ov->entries, ov->entry_count, sizeof(overlay_entry_t), overlay_cmp);
+    for (i = 0, j = 0; i < ov->entry_count; i++) {
+        if (j && ov->entries[j - 1].entry[ENTRY_OBJECTID] == ov->entries[i].entry[ENTRY_OBJECTID])
+            continue;
+        ov->entries[j++] = ov->entries[i];
+    }
+    ov->entry_count = j;
+    return 1;
+}
+
+/*
+    Find object in the highest priority database holding it, returns the
+    index of that database or -1 if not found
+*/
+int overlay_find(
+    overlay_t* ov,
+    uint32_t object_id,
+    uint32_t* entry /* out */)
+{
+    dirnode_t* node;
+    uint32_t entry_ix;
+    int dat_ix;
+
+    for (dat_ix = ov->dat_count - 1; dat_ix >= 0; dat_ix--) {
+        node = dir_search(ov->dats[dat_ix], &ov->caches[dat_ix],
+            header_get_btree(ov->headers[dat_ix]), object_id, &entry_ix);
+        if (node) {
+            memcpy(entry, node->entries[entry_ix], 24);
+            return dat_ix;
+        }
+    }
+    return -1;
+}
+
+/*******************************************************************************
+    
+    ANALYSIS PROCEDURES
+    
+********************************************************************************/
+
+#define MARK_NONE       0
+#define MARK_OBJECT     1
+#define MARK_DIRECTORY  2
+#define MARK_FREE       3
+#define MARK_TAIL       4       /* Chained past the end of its object */
+
+#define ANALYZE_BUCKETS 33
+#define ANALYZE_CANDIDATES 5
+
+/*
+    Block sizes to estimate a rebuilt database's footprint with
+*/
+const uint32_t analyze_block_sizes[ANALYZE_CANDIDATES] = { 256, 512, 1024, 2048, 4096 };
+
+typedef struct {
+    FILE* db;
+    uint32_t block_size;
+    uint32_t block_count;       /* Blocks between header and end of file */
+    unsigned char* marks;       /* One MARK_ per block */
+    uint32_t objects;
+    uint32_t directories;
+    uint32_t mark_counts[MARK_TAIL + 1];
+    unsigned long object_bytes;
+    unsigned long header_bytes;     /* Next pointers of object blocks */
+    unsigned long padding_bytes;    /* Unused tail of last object block */
+    uint32_t links;                 /* Next pointers within objects */
+    uint32_t adjacent_links;        /* ... pointing at the following block */
+    uint32_t free_links;
+    uint32_t free_adjacent_links;
+    uint32_t free_runs;
+    uint32_t largest_free_run;
+    uint32_t cross_linked;
+    uint32_t bad_pointers;
+    uint32_t histogram[ANALYZE_BUCKETS];
+    unsigned long candidate_bytes[ANALYZE_CANDIDATES];
+} analysis_t;
+
+/*
+    Claim block for mark, returns 1 if claimed, 0 if already claimed by
+    another chain and -1 if the pointer is invalid
+*/
+int analyze_mark(
+    analysis_t* an,
+    uint32_t addr,
+    unsigned char mark)
+{
+    uint32_t ix;
+
+    if (addr < 1024 || (addr - 1024) % an->block_size
+            || (addr - 1024) / an->block_size >= an->block_count) {
+        an->bad_pointers++;
+        return -1;
+    }
+    ix = (addr - 1024) / an->block_size;
+    if (an->marks[ix]) {
+        an->cross_linked++;
+        return 0;
+    }
+    an->marks[ix] = mark;
+    an->mark_counts[mark]++;
+    return 1;
+}
+
+/*
+    Walk and mark a chain, including any blocks left chained past size.
+    Blocks already claimed by another chain are counted as cross-linked
+    and the rest of the chain is still marked. The tail walk ends at a
+    pointer carrying the free flag, since that is a free list link. Returns
+    0 if the first block was already claimed
+*/
+int analyze_chain(
+    analysis_t* an,
+    uint32_t offset,
+    uint32_t size,
+    unsigned char mark,
+    char* buffer)               /* Out: chain data of size bytes, or NULL */
+{
+    uint32_t* addrs;
+    uint32_t next;
+    char header[4];
+    uint32_t blocks;
+    int needed, count, ix, first;
+
+    /* A damaged size can claim more blocks than the file holds */
+    blocks = size ? size / (an->block_size - 4) + (size % (an->block_size - 4) != 0) : 1;
+    needed = blocks < an->block_count ? blocks : an->block_count;
+    addrs = needed > 0 ? malloc(needed * sizeof(uint32_t)) : NULL;
+    if (!addrs)
+        return 0;
+    count = db_read_chain(an->db, offset, an->block_size, needed, addrs,
+        buffer, buffer ? (int) size : 0, &next);
+
+    first = count > 0;
+    for (ix = 0; ix < count; ix++) {
+        if (analyze_mark(an, addrs[ix], mark) <= 0 && ix == 0)
+            first = 0;
+        if (ix > 0 && mark == MARK_OBJECT) {
+            an->links++;
+            if (addrs[ix] == addrs[ix - 1] + an->block_size)
+                an->adjacent_links++;
+        }
+    }
+
+    /* Blocks still chained after the object ends */
+    offset = count ? addrs[count - 1] : 0;
+    while (count && next && !(next & 0x80000000) && analyze_mark(an, next, MARK_TAIL) > 0) {
+        offset = next;
+        db_read_block(an->db, offset, 4, header, sizeof(header));
+        next = block_get_next(header);
+    }
+    free(addrs);
+    return first;
+}
+
+void analyze_dir_r(
+    analysis_t* an,
+    uint32_t dir_addr)
+{
+    char dir[DIRECTORY_SIZE];
+    uint32_t* entry;
+    uint32_t size, blocks, bits;
+    int branch_ix, entry_ix, entry_count, i;
+
+    memset(dir, 0, sizeof(dir));
+    if (!analyze_chain(an, dir_addr, DIRECTORY_SIZE, MARK_DIRECTORY, dir))
+        return;
+    an->directories++;
+    entry_count = dir_entry_count(dir);
+    if (entry_count > MAX_BRANCH - 1)
+        entry_count = MAX_BRANCH - 1;
+
+    if (!dir_is_leaf(dir)) {
+        for (branch_ix = 0; branch_ix < entry_count + 1; branch_ix++)
+            analyze_dir_r(an, dir_get_branch(dir, branch_ix));
+    }
+
+    for (entry_ix = 0; entry_ix < entry_count; entry_ix++) {
+        entry = dir_get_entry(dir, entry_ix);
+        size = entry[ENTRY_FILESIZE];
+        an->objects++;
+        an->object_bytes += size;
+
+        for (bits = 0; bits < ANALYZE_BUCKETS - 1 && (size >> bits); bits++)
+            ;
+        an->histogram[bits]++;
+
+        blocks = size ? size / (an->block_size - 4) + (size % (an->block_size - 4) != 0) : 1;
+        an->header_bytes += 4 * blocks;
+        an->padding_bytes += blocks * (an->block_size - 4) - size;
+        for (i = 0; i < ANALYZE_CANDIDATES; i++) {
+            blocks = size ? size / (analyze_block_sizes[i] - 4)
+                + (size % (analyze_block_sizes[i] - 4) != 0) : 1;
+            an->candidate_bytes[i] += (unsigned long) blocks * analyze_block_sizes[i];
+        }
+
+        analyze_chain(an, entry[ENTRY_FILEOFFSET], size, MARK_OBJECT, NULL);
+    }
+}
+
+/*
+    Walk directory, every chain and the free list once, returns 0 on failure
+*/
+int analyze(
+    FILE* db,
+    analysis_t* an)
+{
+    char header[1024];
+    char next[4];
+    uint32_t offset, prev, ix, run, steps;
+    int claimed;
+
+    memset(an, 0, sizeof(analysis_t));
+    db_read_block(db, 0, 1024, header, sizeof(header));
+    an->db = db;
+    an->block_size = header_get_blocksize(header);
+    if (an->block_size <= 4 || header_get_filesize(header) < 1024)
+        return 0;
+    an->block_count = (header_get_filesize(header) - 1024) / an->block_size;
+    an->marks = calloc(an->block_count + 1, 1);
+    if (!an->marks)
+        return 0;
+
+    analyze_dir_r(an, header_get_btree(header));
+
+    /*
+        Free list, in list order. Blocks already claimed by a chain are
+        counted as cross-linked and followed anyway. The walk ends when the
+        list returns to one of its own blocks, or after block_count steps
+    */
+    prev = 0;
+    offset = header_get_free_head(header) & 0x7fffffff;
+    for (steps = 0; offset && steps < an->block_count; steps++) {
+        claimed = analyze_mark(an, offset, MARK_FREE);
+        if (claimed < 0)
+            break;
+        if (!claimed && an->marks[(offset - 1024) / an->block_size] == MARK_FREE)
+            break;              /* List loops back on itself */
+        if (prev) {
+            an->free_links++;
+            if (offset == prev + an->block_size)
+                an->free_adjacent_links++;
+        }
+        db_read_block(db, offset, 4, next, sizeof(next));
+        if (!(block_get_next(next) & 0x80000000))
+            break;
+        prev = offset;
+        offset = block_get_next(next) & 0x7fffffff;
+    }
+
+    /* Free runs, in address order */
+    run = 0;
+    for (ix = 0; ix <= an->block_count; ix++) {
+        if (ix < an->block_count && an->marks[ix] == MARK_FREE) {
+            run++;
+            continue;
+        }
+        if (run) {
+            an->free_runs++;
+            if (run > an->largest_free_run)
+                an->largest_free_run = run;
+        }
+        run = 0;
+    }
+
+    free(an->marks);
+    an->marks = NULL;
+    return 1;
+}
+
+double analyze_pct(
+    unsigned long part,
+    unsigned long whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+uint32_t analyze_leaked(
+    analysis_t* an)
+{
+    uint32_t used;
+    int i;
+
+    used = 0;
+    for (i = MARK_OBJECT; i <= MARK_TAIL; i++)
+        used += an->mark_counts[i];
+    return an->block_count - used;
+}
+
+void analyze_print_text(
+    analysis_t* an)
+{
+    unsigned long allocated;
+    int i;
+
+    allocated = (unsigned long) an->mark_counts[MARK_OBJECT] * an->block_size;
+    printf("Block Size:         %d\n", an->block_size);
+    printf("Blocks:             %d\n", an->block_count);
+    printf("  Object:           %d\n", an->mark_counts[MARK_OBJECT]);
+    printf("  Directory:        %d\n", an->mark_counts[MARK_DIRECTORY]);
+    printf("  Free:             %d\n", an->mark_counts[MARK_FREE]);
+    printf("  Chain Tail:       %d\n", an->mark_counts[MARK_TAIL]);
+    printf("  Leaked:           %d\n", analyze_leaked(an));
+    printf("Objects:            %d\n", an->objects);
+    printf("Directories:        %d\n", an->directories);
+    printf("Object Bytes:       %lu\n", an->object_bytes);
+    printf("Header Slack:       %lu (%.1f%%)\n", an->header_bytes, analyze_pct(an->header_bytes, allocated));
+    printf("Padding Slack:      %lu (%.1f%%)\n", an->padding_bytes, analyze_pct(an->padding_bytes, allocated));
+    printf("Slack Per Block:    %.1f\n", an->mark_counts[MARK_OBJECT]
+        ? (double) (an->header_bytes + an->padding_bytes) / an->mark_counts[MARK_OBJECT] : 0.0);
+    printf("Chain Contiguity:   %d/%d (%.1f%%)\n", an->adjacent_links, an->links,
+        analyze_pct(an->adjacent_links, an->links));
+    printf("Free Runs:          %d\n", an->free_runs);
+    printf("Largest Free Run:   %d\n", an->largest_free_run);
+    printf("Free List Order:    %d/%d adjacent (%.1f%%)\n", an->free_adjacent_links, an->free_links,
+        analyze_pct(an->free_adjacent_links, an->free_links));
+    printf("Cross-linked:       %d\n", an->cross_linked);
+    printf("Bad Pointers:       %d\n", an->bad_pointers);
+
+    printf("\nObject Sizes:\n");
+    for (i = 0; i < ANALYZE_BUCKETS; i++) {
+        if (an->histogram[i])
+            printf("  %10lu - %10lu  %d\n",
+                i ? 1UL << (i - 1) : 0UL, i ? (1UL << i) - 1 : 0UL, an->histogram[i]);
     }
-    return r;
+
+    printf("\nRebuilt Size By Block Size:\n");
+    for (i = 0; i < ANALYZE_CANDIDATES; i++)
+        printf("  %4d  %lu (%.1f%% slack)\n", analyze_block_sizes[i], an->candidate_bytes[i],
+            analyze_pct(an->candidate_bytes[i] - an->object_bytes, an->candidate_bytes[i]));
 }
 
-uint32_t cb_replace(uint32_t* entry, void* params) {
-    uint32_t* newEntry = (uint32_t*) params;
-    if (entry[ENTRY_OBJECTID] == newEntry[ENTRY_OBJECTID]) {
-        entry[ENTRY_BITFLAGS]    = newEntry[ENTRY_BITFLAGS];
-        entry[ENTRY_OBJECTID]    = newEntry[ENTRY_OBJECTID];
-        entry[ENTRY_FILEOFFSET]  = newEntry[ENTRY_FILEOFFSET];
-        entry[ENTRY_FILESIZE]    = newEntry[ENTRY_FILESIZE];
-        entry[ENTRY_DATE]        = newEntry[ENTRY_DATE];
-        entry[ENTRY_VERSION]     = newEntry[ENTRY_VERSION];
-        return 1;
-   }
-   return 0;
+void analyze_print_json(
+    analysis_t* an)
+{
+    int i, first;
+
+    printf("{\n");
+    printf("  \"block_size\": %d,\n", an->block_size);
+    printf("  \"blocks\": {\"total\": %d, \"object\": %d, \"directory\": %d, "
+        "\"free\": %d, \"chain_tail\": %d, \"leaked\": %d},\n",
+        an->block_count, an->mark_counts[MARK_OBJECT], an->mark_counts[MARK_DIRECTORY],
+        an->mark_counts[MARK_FREE], an->mark_counts[MARK_TAIL], analyze_leaked(an));
+    printf("  \"objects\": %d,\n", an->objects);
+    printf("  \"directories\": %d,\n", an->directories);
+    printf("  \"object_bytes\": %lu,\n", an->object_bytes);
+    printf("  \"slack\": {\"header_bytes\": %lu, \"padding_bytes\": %lu},\n",
+        an->header_bytes, an->padding_bytes);
+    printf("  \"contiguity\": {\"links\": %d, \"adjacent\": %d},\n",
+        an->links, an->adjacent_links);
+    printf("  \"free_list\": {\"runs\": %d, \"largest_run\": %d, \"links\": %d, \"adjacent\": %d},\n",
+        an->free_runs, an->largest_free_run, an->free_links, an->free_adjacent_links);
+    printf("  \"cross_linked\": %d,\n", an->cross_linked);
+    printf("  \"bad_pointers\": %d,\n", an->bad_pointers);
+
+    printf("  \"size_histogram\": [");
+    for (i = 0, first = 1; i < ANALYZE_BUCKETS; i++) {
+        if (!an->histogram[i])
+            continue;
+        printf("%s\n    {\"min\": %lu, \"max\": %lu, \"count\": %d}", first ? "" : ",",
+            i ? 1UL << (i - 1) : 0UL, i ? (1UL << i) - 1 : 0UL, an->histogram[i]);
+        first = 0;
+    }
+    printf("\n  ],\n");
+
+    printf("  \"rebuilt_bytes\": {");
+    for (i = 0; i < ANALYZE_CANDIDATES; i++)
+        printf("%s\"%d\": %lu", i ? ", " : "", analyze_block_sizes[i], an->candidate_bytes[i]);
+    printf("}\n");
+    printf("}\n");
 }
 
 /*******************************************************************************
@@ -380,19 +1319,41 @@ void util_print_header(char* header)
 int util_find_object(
     FILE* db,
     char* header,
+    dircache_t* cache,
     uint32_t object_id,
     uint32_t* entry /* out */)
 {
-    entry[ENTRY_OBJECTID] = object_id;
-    return crawl(db, header, cb_find, entry);
+    dirnode_t* node;
+    uint32_t entry_ix;
+
+    node = dir_search(db, cache, header_get_btree(header), object_id, &entry_ix);
+    if (!node)
+        return 0;
+    memcpy(entry, node->entries[entry_ix], 24);
+    return 1;
 }
 
 int util_replace_entry(
     FILE* db,
     char* header,
+    dircache_t* cache,
     uint32_t* entry)
 {
-    return crawl(db, header, cb_replace, entry);
+    dirnode_t* node;
+    uint32_t dir_addr, entry_ix;
+    char dir[DIRECTORY_SIZE];
+
+    node = dir_search(db, cache, header_get_btree(header), entry[ENTRY_OBJECTID], &entry_ix);
+    if (!node)
+        return 0;
+
+    /* Patch entry in raw directory and drop the stale decoded copy */
+    dir_addr = node->addr;
+    db_read_object(db, dir_addr, cache->block_size, DIRECTORY_SIZE, dir, sizeof(dir));
+    memcpy(dir_get_entry(dir, entry_ix), entry, 24);
+    db_write_object(db, dir_addr, cache->block_size, DIRECTORY_SIZE, dir, sizeof(dir), NULL);
+    dircache_invalidate(cache, dir_addr);
+    return 1;
 }
 
 
@@ -408,57 +1369,118 @@ void util_print_objects(
     crawl(db, header, cb_print, NULL);
 }
 
+void util_print_entry(
+    uint32_t* entry)
+{
+    printf("Object ID:          %08X\n", entry[ENTRY_OBJECTID]);
+    printf("Bit Flags:          %08X\n", entry[ENTRY_BITFLAGS]);
+    printf("Version:            %08X\n", entry[ENTRY_VERSION]);
+    printf("File Offset:        %08X\n", entry[ENTRY_FILEOFFSET]);
+    printf("File Size:          %d\n", entry[ENTRY_FILESIZE]);
+    printf("Date:               %08X\n", entry[ENTRY_DATE]);
+}
+
+/*
+    Write object described by entry out to a file
+*/
+void util_save_object(
+    FILE* db,
+    uint32_t block_size,
+    uint32_t* entry,
+    char* to_file_str)
+{
+    FILE* out;
+    char* buffer;
+
+    buffer = malloc(entry[ENTRY_FILESIZE]);
+    db_read_object(
+        db,
+        entry[ENTRY_FILEOFFSET],
+        block_size,
+        entry[ENTRY_FILESIZE],
+        buffer,
+        entry[ENTRY_FILESIZE]);
+
+    out = fopen(to_file_str, "wb");
+    fwrite(buffer, entry[ENTRY_FILESIZE], 1, out);
+    fclose(out);
+    free(buffer);
+}
+
+void util_stat_object(
+    FILE* db,
+    char* object_id_str)
+{
+    uint32_t entry[6];
+    uint32_t object_id;
+    dircache_t cache;
+    char header[1024];
+
+    /* Read header */
+    db_read_block(db, 0, 1024, header, sizeof(header));
+    if (!dircache_init(&cache, header_get_blocksize(header), DIRCACHE_SLOTS)) {
+        printf("Out of memory.\n");
+        return;
+    }
+
+    /* Parse object id from object id string */
+    sscanf(object_id_str, "%08X", &object_id);
+
+    if (util_find_object(db, header, &cache, object_id, entry))
+        util_print_entry(entry);
+    else
+        printf("Object not found.\n");
+    dircache_release(&cache);
+}
+
 void util_export_object(
     FILE* db,
     char* object_id_str,
 	char* to_file_str)
 {
-    FILE* out;
     uint32_t entry[6];
     uint32_t object_id;
-    char* buffer;
+    dircache_t cache;
     char header[1024];
 
     /* Read header */
     db_read_block(db, 0, 1024, header, sizeof(header));
+    if (!dircache_init(&cache, header_get_blocksize(header), DIRCACHE_SLOTS)) {
+        printf("Out of memory.\n");
+        return;
+    }
 
     /* Parse object id from object id string */
     sscanf(object_id_str, "%08X", &object_id);
     
     /* Find object */
-    if (util_find_object(db, header, object_id, entry)) {
+    if (util_find_object(db, header, &cache, object_id, entry)) {
         
         /* Export object to file */
-        buffer = malloc(entry[ENTRY_FILESIZE]);
-        db_read_object(
-            db,
-            entry[ENTRY_FILEOFFSET],
-            header_get_blocksize(header),
-            entry[ENTRY_FILESIZE],
-            buffer,
-            entry[ENTRY_FILESIZE]);
-        
-        out = fopen(to_file_str, "wb");
-        fwrite(buffer, entry[ENTRY_FILESIZE], 1, out);
-        fclose(out);
-        free(buffer);
+        util_save_object(db, header_get_blocksize(header), entry, to_file_str);
         
     } else {
         printf("Object not found.\n");
     }
+    dircache_release(&cache);
 }
 
 void util_replace_object(
     FILE* db,
     char* object_id_str,
-	char* from_file_str)
+	char* from_file_str,
+    int contiguous)
 {
     FILE* out;
+    freemap_t fm;
+    dircache_t cache;
     uint32_t size;
     uint32_t entry[6];
     uint32_t object_id;
     uint32_t free_count;
     uint32_t block_size;
+    uint32_t next;
+    int needed, loaded;
     char* buffer;
     char header[1024];
 
@@ -466,12 +1488,16 @@ void util_replace_object(
     db_read_block(db, 0, 1024, header, sizeof(header));
     block_size = header_get_blocksize(header);
     free_count = header_get_freecount(header);
+    if (!dircache_init(&cache, block_size, DIRCACHE_SLOTS)) {
+        printf("Out of memory.\n");
+        return;
+    }
 
     /* Parse object id from object id string */
     sscanf(object_id_str, "%08X", &object_id);
     
     /* Find object */
-    if (util_find_object(db, header, object_id, entry)) {
+    if (util_find_object(db, header, &cache, object_id, entry)) {
         
         /* Read entire file into buffer */
         out = fopen(from_file_str, "rb");
@@ -484,36 +1510,179 @@ void util_replace_object(
             fclose(out);
         } else {
             printf("Unable to load replacement object.\n");
+            dircache_release(&cache);
             return;
         }
         
         if ((int)(size - entry[ENTRY_FILESIZE]) > (int)((block_size - 4) * free_count)) {
             printf("Not enough space in database. Try expanding.\n");
             free(buffer);
+            dircache_release(&cache);
             return;
         }
 
+        loaded = contiguous ? freemap_load(db, &fm) : 1;
+        if (loaded <= 0) {
+            if (loaded < 0)
+                printf("Out of memory.\n");
+            else
+                printf("Free list is inconsistent, refusing to rewrite it.\n");
+            free(buffer);
+            dircache_release(&cache);
+            return;
+        }
+
+        /* The header's free count can run ahead of the list, check the map */
+        needed = size ? (size + block_size - 5) / (block_size - 4) : 0;
+        if (contiguous && needed) {
+            needed -= db_read_chain(db, entry[ENTRY_FILEOFFSET], block_size,
+                needed, NULL, NULL, 0, &next);
+            if (needed > 0 && (uint32_t) needed > fm.count) {
+                printf("Not enough space in database. Try expanding.\n");
+                freemap_release(&fm);
+                free(buffer);
+                dircache_release(&cache);
+                return;
+            }
+        }
+
         db_write_object(
             db,
             entry[ENTRY_FILEOFFSET],
             header_get_blocksize(header),
             size,
             buffer,
-            size);
+            size,
+            contiguous ? &fm : NULL);
             
         free(buffer);
+
+        if (contiguous) {
+            freemap_store(db, &fm);
+            freemap_release(&fm);
+        }
         
         if (entry[ENTRY_FILESIZE] != size) {
             entry[ENTRY_FILESIZE] = size;
-            util_replace_entry(db, header, entry);
+            util_replace_entry(db, header, &cache, entry);
         }
         
     } else {
         printf("Original object not found in database.\n");
     }
+    dircache_release(&cache);
 }       
 
 
+void util_overlay_print_objects(
+    overlay_t* ov)
+{
+    int i;
+    uint32_t* entry;
+
+    for (i = 0; i < ov->entry_count; i++) {
+        entry = ov->entries[i].entry;
+        printf("%08X %08X %08X %08X %d %s\n",
+            entry[ENTRY_OBJECTID],
+            entry[ENTRY_BITFLAGS],
+            entry[ENTRY_VERSION],
+            entry[ENTRY_FILEOFFSET],
+            entry[ENTRY_FILESIZE],
+            ov->names[ov->entries[i].dat_ix]);
+    }
+}
+
+void util_overlay_export_object(
+    overlay_t* ov,
+    char* object_id_str,
+    char* to_file_str)
+{
+    uint32_t object_id;
+    uint32_t entry[6];
+    int dat_ix;
+
+    /* Parse object id from object id string */
+    sscanf(object_id_str, "%08X", &object_id);
+
+    dat_ix = overlay_find(ov, object_id, entry);
+    if (dat_ix >= 0) {
+        util_save_object(
+            ov->dats[dat_ix],
+            header_get_blocksize(ov->headers[dat_ix]),
+            entry,
+            to_file_str);
+    } else {
+        printf("Object not found.\n");
+    }
+}
+
+void util_overlay_stat_object(
+    overlay_t* ov,
+    char* object_id_str)
+{
+    uint32_t object_id;
+    uint32_t entry[6];
+    int dat_ix;
+
+    /* Parse object id from object id string */
+    sscanf(object_id_str, "%08X", &object_id);
+
+    dat_ix = overlay_find(ov, object_id, entry);
+    if (dat_ix >= 0) {
+        util_print_entry(entry);
+        printf("Database:           %s\n", ov->names[dat_ix]);
+    } else {
+        printf("Object not found.\n");
+    }
+}
+
+void util_analyze(
+    FILE* db,
+    char* format_str)
+{
+    analysis_t an;
+
+    if (!analyze(db, &an)) {
+        printf("Unable to analyze database.\n");
+        return;
+    }
+    if (format_str && format_str[0] == 'j')
+        analyze_print_json(&an);
+    else
+        analyze_print_text(&an);
+}
+
+/*
+    Run a read-only mode over a stack of databases
+*/
+void util_overlay(
+    char mode,
+    char** argv)
+{
+    overlay_t ov;
+
+    if (mode != 'l' && mode != 'x' && mode != 's') {
+        printf("Only l, x and s work on a stack of databases.\n");
+        return;
+    }
+    if (!overlay_open(&ov, argv[2]))
+        return;
+
+    switch (mode) {
+        case 'l':
+            if (overlay_build_index(&ov))
+                util_overlay_print_objects(&ov);
+            break;
+        case 'x':
+            util_overlay_export_object(&ov, argv[3], argv[4]);
+            break;
+        case 's':
+            util_overlay_stat_object(&ov, argv[3]);
+            break;
+    }
+    overlay_close(&ov);
+}
+
 /*******************************************************************************
     
     MAIN
@@ -527,6 +1696,17 @@ int main(int argc, char** argv) {
         printf("acpatch l <datfile>                       list contents of database\n");
         printf("acpatch x <datfile> <object> <tofile>     export object\n");
         printf("acpatch r <datfile> <object> <fromfile>   replace object\n");
+        printf("acpatch c <datfile> <object> <fromfile>   replace object, keeping its blocks contiguous\n");
+        printf("acpatch s <datfile> <object>              print directory entry of object\n");
+        printf("acpatch a <datfile> [text|json]           report space use and fragmentation\n");
+        printf("\n");
+        printf("For l, x and s <datfile> may be a comma separated stack of databases,\n");
+        printf("each overriding the objects of those before it.\n");
+        return 0;
+    }
+
+    if (strchr(argv[2], ',')) {
+        util_overlay(argv[1][0], argv);
         return 0;
     }
 
@@ -544,7 +1724,16 @@ int main(int argc, char** argv) {
             util_export_object(db, argv[3], argv[4]);
             break;
         case 'r':
-            util_replace_object(db, argv[3], argv[4]);
+            util_replace_object(db, argv[3], argv[4], 0);
+            break;
+        case 'c':
+            util_replace_object(db, argv[3], argv[4], 1);
+            break;
+        case 's':
+            util_stat_object(db, argv[3]);
+            break;
+        case 'a':
+            util_analyze(db, argc > 3 ? argv[3] : NULL);
             break;
         default:
             printf("Invalid mode.\n");